@@ -1,7 +1,15 @@
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 // Datanorm 3: https://www.kommunal-edv.de/wissen/it-technik/schnittstellen/datanorm/
 // Datanorm 5: https://docplayer.org/115761786-Technische-spezifikationen-der-datanorm-dateien-in-haufe-lexware.html
@@ -76,6 +84,62 @@ typedef struct PList
 
 
 
+/*
+ Memory
+ Everything referenced by the product list is allocated from a per-thread arena,
+ so a whole catalog can be released at once after it has been written.
+*/
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+    max_align_t data[];
+} ArenaChunk;
+
+static __thread ArenaChunk* arena = NULL;
+// Set while a supplier is processed, allocation failures jump back there instead of ending the process
+static __thread jmp_buf* arenaFailure = NULL;
+
+// Passes successful allocations through, a failed one ends the current supplier (or the process outside of one)
+void* checkAlloc(void* ptr) {
+    if (ptr == NULL) {
+        if (arenaFailure != NULL) {
+            longjmp(*arenaFailure, 1);
+        }
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void* arenaAlloc(size_t size) {
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    if (arena == NULL || arena->size - arena->used < size) {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk* chunk = checkAlloc(malloc(sizeof(ArenaChunk) + chunkSize));
+        chunk->next = arena;
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        arena = chunk;
+    }
+
+    void* ptr = (char*) arena->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+void arenaRelease() {
+    while (arena != NULL) {
+        ArenaChunk* next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+
+
 /*
  Utility
 */
@@ -88,7 +152,7 @@ char **split(const char *str, char sep)
 {
     char **array;
     unsigned int start = 0, stop, toks = 0, t;
-    token *tokens = malloc((strlen(str) + 1) * sizeof(token));
+    token *tokens = checkAlloc(malloc((strlen(str) + 1) * sizeof(token)));
     for (stop = 0; str[stop]; stop++) {
         if (str[stop] == sep) {
             tokens[toks].start = str + start;
@@ -101,10 +165,10 @@ char **split(const char *str, char sep)
     tokens[toks].start = str + start;
     tokens[toks].len = stop - start;
     toks++;
-    array = malloc((toks + 1) * sizeof(char*));
+    array = checkAlloc(malloc((toks + 1) * sizeof(char*)));
     for (t = 0; t < toks; t++) {
         /* Calloc makes it nul-terminated */
-        char *token = calloc(tokens[t].len + 1, 1);
+        char *token = checkAlloc(calloc(tokens[t].len + 1, 1));
         memcpy(token, tokens[t].start, tokens[t].len);
         array[t] = token;
     }
@@ -134,6 +198,31 @@ void dump(PList* pList) {
     }
 }
 
+char* formatString(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char* str = checkAlloc(malloc(len + 1));
+    va_start(args, format);
+    vsnprintf(str, len + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
 size_t arraylength(char** array) {
     size_t len = 0;
     while (array[len] != NULL) {
@@ -144,7 +233,7 @@ size_t arraylength(char** array) {
 }
 
 char* ccpy(char* origin) {
-    char* new = malloc(stringlength(origin)+1);
+    char* new = arenaAlloc(stringlength(origin)+1);
     strcpy(new, origin);
     return new;
 }
@@ -155,7 +244,7 @@ char* concat(char* s1, char* s2, char* s3) {
         offset = 1;
     }
 
-    char* total = malloc(stringlength(s1)+stringlength(s2)+stringlength(s3)+offset);
+    char* total = arenaAlloc(stringlength(s1)+stringlength(s2)+stringlength(s3)+offset);
     strcpy(total, s1);
     strcat(total, s2);
     if (offset == 2) strcat(total, " ");
@@ -172,13 +261,140 @@ void freeSet(char** set) {
 }
 
 
+/*
+ Error reporting
+ Malformed lines are collected per output into a buffered sidecar file
+ (file;line;set;reason) instead of being printed inline.
+*/
+typedef struct ErrorLog {
+    char* path;
+    FILE* fp; // Opened on the first error
+    const char* file; // Input file currently parsed
+    size_t line; // Line number within file
+    size_t lines; // Distinct malformed lines, a line can have several errors
+    const char* lastFile; // Position of the last reported error
+    size_t lastLine;
+    // With the cache, entries are also kept with the file's position in the file list
+    // instead of its path (index;line;set;reason), so snapshots do not depend on paths
+    uint8_t keepEntries;
+    size_t fileIndex;
+    char* entries;
+    size_t entriesSize;
+    size_t entriesCap;
+} ErrorLog;
+
+static __thread ErrorLog* errorLog = NULL;
+
+int openErrorLog(ErrorLog* log, uint8_t withHeader) {
+    log->fp = fopen(log->path, "w");
+    if (log->fp == NULL) {
+        return -1;
+    }
+    setvbuf(log->fp, NULL, _IOFBF, 1 << 16);
+    if (withHeader) {
+        fprintf(log->fp, "Datei;Zeile;Satzart;Fehler\n");
+    }
+    return 0;
+}
+
+void appendEntries(ErrorLog* log, const char* entries, size_t size) {
+    if (log->entriesSize + size > log->entriesCap) {
+        size_t cap = log->entriesCap == 0 ? 4096 : log->entriesCap;
+        while (log->entriesSize + size > cap) cap *= 2;
+        log->entries = checkAlloc(realloc(log->entries, cap));
+        log->entriesCap = cap;
+    }
+    memcpy(log->entries + log->entriesSize, entries, size);
+    log->entriesSize += size;
+}
+
+void reportError(char setId, const char* field, const char* reason) {
+    if (errorLog == NULL) {
+        return;
+    }
+
+    if (errorLog->fp == NULL && openErrorLog(errorLog, 1) != 0) {
+        return;
+    }
+
+    fprintf(errorLog->fp, "%s;%zu;%c;%s%s%s\n",
+        errorLog->file, errorLog->line, setId > ' ' ? setId : '?',
+        field, stringlength(field) > 0 ? ": " : "", reason);
+    if (errorLog->keepEntries) {
+        char* entry = formatString("%zu;%zu;%c;%s%s%s\n",
+            errorLog->fileIndex, errorLog->line, setId > ' ' ? setId : '?',
+            field, stringlength(field) > 0 ? ": " : "", reason);
+        appendEntries(errorLog, entry, stringlength(entry));
+        free(entry);
+    }
+    if (errorLog->line != errorLog->lastLine || errorLog->file != errorLog->lastFile) {
+        errorLog->lines++;
+        errorLog->lastFile = errorLog->file;
+        errorLog->lastLine = errorLog->line;
+    }
+}
+
+
+
+/*
+ Numeric fields
+ Datanorm numbers are unsigned decimal digits, optionally padded with blanks.
+ Empty fields count as 0, anything else that is not a digit is rejected.
+*/
+typedef enum NumberError {
+    NUMBER_OK,
+    NUMBER_FORMAT,
+    NUMBER_OVERFLOW
+} NumberError;
+
+NumberError parseNumber(const char* field, uint64_t max, uint64_t* value) {
+    *value = 0;
+    if (field == NULL) {
+        return NUMBER_OK;
+    }
+
+    const char* c = field;
+    while (*c == ' ') c++;
+
+    uint64_t result = 0;
+    for (; *c >= '0' && *c <= '9'; c++) {
+        uint64_t digit = *c - '0';
+        if (digit > max || result > (max - digit) / 10) {
+            return NUMBER_OVERFLOW;
+        }
+        result = result * 10 + digit;
+    }
+
+    while (*c == ' ' || *c == '\r' || *c == '\n') c++;
+    if (*c != '\0') {
+        return NUMBER_FORMAT;
+    }
+
+    *value = result;
+    return NUMBER_OK;
+}
+
+// Parses a numeric field, reports malformed values and falls back to 0
+uint64_t numberField(char setId, const char* name, const char* field, uint64_t max) {
+    uint64_t value;
+    NumberError error = parseNumber(field, max, &value);
+    if (error == NUMBER_FORMAT) {
+        reportError(setId, name, "not a number");
+    } else if (error == NUMBER_OVERFLOW) {
+        reportError(setId, name, "value too large");
+    }
+    return value;
+}
+
+
+
 /*
  Line pre-processing
 */
 void escapeSpecialChars(char** line, size_t len) {
     char x = (*line)[0];
-    char* lineToNow = malloc(len < 240 ? 240 : len);
-    size_t newLength = len;
+    // Every replacement turns one byte into two
+    char* lineToNow = checkAlloc(malloc(2 * len));
     size_t lineToNowIdx = 0;
     uint8_t delimsHave = 0;
     uint8_t delimsShould = 0;
@@ -205,13 +421,9 @@ void escapeSpecialChars(char** line, size_t len) {
                 case -99: replaceStr = "Ø"; break;
                 case -77: replaceStr = "³"; break;
                 case -3: replaceStr = "²"; break;
-                default: printf("unknown %d %s\n", x, *line); break;
+                default: reportError((*line)[0], "", "unknown character"); break;
             }
 
-            char* newLineToNow = malloc(++newLength);
-            strncpy(newLineToNow, lineToNow, newLength);
-            strncpy(lineToNow, newLineToNow, len < 240 ? 240 : len);
-
             lineToNow[lineToNowIdx++] = replaceStr[0];
             lineToNow[lineToNowIdx++] = replaceStr[1];
         } else {
@@ -226,7 +438,7 @@ void escapeSpecialChars(char** line, size_t len) {
         }
     }
 
-    char* finalLine = malloc(lineToNowIdx);
+    char* finalLine = checkAlloc(malloc(lineToNowIdx));
     strncpy(finalLine, lineToNow, lineToNowIdx);
     free(lineToNow);
     for (size_t i = 0; i < lineToNowIdx-1; i++) {
@@ -246,7 +458,7 @@ void escapeSpecialChars(char** line, size_t len) {
 void initPListItem(PList* item) {
     item->artNr = "";
     item->longTextKey = "";
-    item->product = malloc(sizeof(Product));
+    item->product = arenaAlloc(sizeof(Product));
     item->next = NULL;
 
     item->product->artNr = "";
@@ -260,6 +472,7 @@ void initPListItem(PList* item) {
     item->product->measure = "";
     item->product->price = 0;
     item->product->discountGroup = "";
+    item->product->discountType = 0;
     item->product->discount = 0;
     item->product->articleGroup = "";
     item->product->longTextKey = "";
@@ -283,6 +496,80 @@ void initPListItem(PList* item) {
 
 
 
+/*
+ Product index
+ Article number -> first list item with that number. P sets are looked up here
+ instead of scanning the list. A and P sets index the items they create or give
+ an article number, T sets never set one. Only a list restored from the cache
+ marks the index dirty, it is then rebuilt before the next P set.
+*/
+typedef struct ProductIndex {
+    PList** slots;
+    size_t capacity; // Power of two
+    size_t count;
+    uint8_t dirty;
+} ProductIndex;
+
+size_t indexSlot(ProductIndex* index, const char* artNr) {
+    size_t mask = index->capacity - 1;
+    size_t slot = fnv1a(FNV_OFFSET, artNr, stringlength(artNr)) & mask;
+    while (index->slots[slot] != NULL && strcmp(index->slots[slot]->artNr, artNr) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+PList* findProduct(ProductIndex* index, const char* artNr) {
+    if (index->capacity == 0) {
+        return NULL;
+    }
+    return index->slots[indexSlot(index, artNr)];
+}
+
+// replace = 0 keeps an existing entry (rebuilding walks the list front to back),
+// replace = 1 is for items that are or will be in front of every other item with that number
+void indexProduct(ProductIndex* index, PList* item, uint8_t replace) {
+    if (item->artNr == NULL || stringlength(item->artNr) == 0) {
+        return;
+    }
+
+    if ((index->count + 1) * 2 > index->capacity) {
+        PList** oldSlots = index->slots;
+        size_t oldCapacity = index->capacity;
+        size_t capacity = oldCapacity == 0 ? 1024 : oldCapacity * 2;
+        // Allocate before touching the index, so it stays intact if this fails
+        index->slots = checkAlloc(calloc(capacity, sizeof(PList*)));
+        index->capacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (oldSlots[i] != NULL) {
+                index->slots[indexSlot(index, oldSlots[i]->artNr)] = oldSlots[i];
+            }
+        }
+        free(oldSlots);
+    }
+
+    size_t slot = indexSlot(index, item->artNr);
+    if (index->slots[slot] == NULL) {
+        index->slots[slot] = item;
+        index->count++;
+    } else if (replace) {
+        index->slots[slot] = item;
+    }
+}
+
+void rebuildIndex(ProductIndex* index, PList* pList) {
+    if (index->capacity > 0) {
+        memset(index->slots, 0, index->capacity * sizeof(PList*));
+    }
+    index->count = 0;
+    for (PList* item = pList; item != NULL; item = item->next) {
+        indexProduct(index, item, 0);
+    }
+    index->dirty = 0;
+}
+
+
+
 /*
  Set processing
 */
@@ -294,13 +581,12 @@ void build_T_Product(PList* item, char** tset, uint8_t init) {
     if (item->product->longTexts == NULL || stringlength(item->product->longTexts) == 0) {
         item->product->longTexts = concat(item->product->longTexts, tset[6], tset[9]);
     } else {
-        char* total = malloc(stringlength(item->product->longTexts)+stringlength(tset[6])+stringlength(tset[9])+3);
+        char* total = arenaAlloc(stringlength(item->product->longTexts)+stringlength(tset[6])+stringlength(tset[9])+3);
         strcpy(total, item->product->longTexts);
         strcat(total, " ");
         strcat(total, tset[6]);
         strcat(total, " ");
         strcat(total, tset[9]);
-        free(item->product->longTexts);
         item->product->longTexts = total;
     }
 
@@ -320,7 +606,9 @@ PList* check_T_Set(char** line, PList* pList) {
     char** tset = split(*line, ';');
     
     if (arraylength(tset) != 11) {
-        printf("PARSE ERROR %s\n", *line);
+        reportError('T', "", "expected 11 fields");
+        freeSet(tset);
+        free(tset);
         return NULL;
     }
 
@@ -335,7 +623,7 @@ PList* check_T_Set(char** line, PList* pList) {
     }
     
     if (found == 0) {
-        PList* newPListItem = malloc(sizeof(PList));
+        PList* newPListItem = arenaAlloc(sizeof(PList));
         build_T_Product(newPListItem, tset, 1);
         freeSet(tset);
         free(tset);
@@ -348,7 +636,7 @@ PList* check_T_Set(char** line, PList* pList) {
     return NULL;
 }
 
-void build_A_Product(PList* item, char** aset, uint8_t init) {
+void build_A_Product(PList* item, char** aset, uint8_t init, ProductIndex* index) {
     if (init != 0) {
         initPListItem(item);
     }
@@ -357,6 +645,8 @@ void build_A_Product(PList* item, char** aset, uint8_t init) {
         char* aset2 = ccpy(aset[2]);
         item->artNr = aset2;
         item->product->artNr = aset2;
+        // check_A_Set stops at the first item with this number, so this item comes before any other one
+        indexProduct(index, item, 1);
     }
     
     if (stringlength(aset[1]) != 0) {
@@ -376,11 +666,11 @@ void build_A_Product(PList* item, char** aset, uint8_t init) {
     }
     
     if (aset[7] != NULL && stringlength(aset[7]) > 0) {
-        item->product->priceMeasure = atoi(aset[7]);
+        item->product->priceMeasure = numberField('A', "A-7", aset[7], 3);
     }
     
     if (item->product->price <= 0) {
-        item->product->price = atol(aset[9]);
+        item->product->price = numberField('A', "A-9", aset[9], INT64_MAX);
     }
     
     if (item->product->discountGroup == NULL || stringlength(item->product->discountGroup) == 0) {
@@ -398,17 +688,21 @@ void build_A_Product(PList* item, char** aset, uint8_t init) {
     }
 }
 
-PList* check_A_Set(char** line, PList* pList) {
+PList* check_A_Set(char** line, PList* pList, ProductIndex* index) {
     char** aset = split(*line, ';');
 
     if (arraylength(aset) != 14) {
-        printf("PARSE ERROR %s\n", *line);
+        reportError('A', "", "expected 14 fields");
+        freeSet(aset);
+        free(aset);
         return NULL;
     }
 
     char* artNr = aset[2];
     if (artNr == 0 || stringlength(artNr) <= 1) {
-        printf("WARN: A-Set line without Article Number\n");
+        reportError('A', "A-2", "missing article number");
+        freeSet(aset);
+        free(aset);
         return NULL;
     }
 
@@ -421,7 +715,7 @@ PList* check_A_Set(char** line, PList* pList) {
         }
 
         if (strcmp(aset[2], item->artNr) == 0) {
-            build_A_Product(item, aset, 0);
+            build_A_Product(item, aset, 0, index);
             freeSet(aset);
             free(aset);
             return NULL;
@@ -429,13 +723,13 @@ PList* check_A_Set(char** line, PList* pList) {
 
         if (stringlength(aset[12]) > 0 && strcmp(aset[12], item->longTextKey) == 0) {
             if (strcmp(item->artNr, artNr) == 0 || stringlength(item->artNr) == 0) {
-                build_A_Product(item, aset, 0);
+                build_A_Product(item, aset, 0, index);
                 found = 1;
                 break;
             } else {
                 // Multiple products using this longTextKey
-                PList* copiedNewItem = malloc(sizeof(PList));
-                build_A_Product(copiedNewItem, aset, 1);
+                PList* copiedNewItem = arenaAlloc(sizeof(PList));
+                build_A_Product(copiedNewItem, aset, 1, index);
                 copiedNewItem->product->longTexts = item->product->longTexts;
                 if (stringlength(copiedNewItem->product->name1) == 0 || strcmp(copiedNewItem->product->name1, "") == 0) {
                     copiedNewItem->product->name1 = item->product->name1;
@@ -459,8 +753,8 @@ PList* check_A_Set(char** line, PList* pList) {
     }
     
     if (found == 0) {
-        PList* newPListItem = malloc(sizeof(PList));
-        build_A_Product(newPListItem, aset, 1);
+        PList* newPListItem = arenaAlloc(sizeof(PList));
+        build_A_Product(newPListItem, aset, 1, index);
         freeSet(aset);
         free(aset);
         return newPListItem;
@@ -472,83 +766,112 @@ PList* check_A_Set(char** line, PList* pList) {
     return NULL;
 }
 
-void build_P_Product(PList* item, char** adjustedPset, uint8_t init) {
+// One DATPREIS record, the fields point into the line
+typedef struct PriceRecord {
+    char* artNr; // P-2
+    char* isPriceExclVAT; // P-3
+    char* price; // P-4
+    char* discountType[3]; // P-5, P-7, P-9
+    char* discount[3]; // P-6, P-8, P-10
+} PriceRecord;
+
+#define P_RECORD_FIELDS 9
+
+void build_P_Product(PList* item, PriceRecord* record, uint8_t init) {
     if (init != 0) {
         initPListItem(item);
     }
 
     if (stringlength(item->artNr) == 0) {
-        item->artNr = adjustedPset[0];
-        item->product->artNr = adjustedPset[0];
+        char* artNr = ccpy(record->artNr);
+        item->artNr = artNr;
+        item->product->artNr = artNr;
     }
 
-    item->product->isPriceExclVAT = ccpy(adjustedPset[1]);
-    item->product->price = atol(adjustedPset[2]);
+    item->product->isPriceExclVAT = ccpy(record->isPriceExclVAT);
+    item->product->price = numberField('P', "P-4", record->price, INT64_MAX);
 
-    item->product->discountTypeA = atoi(adjustedPset[3]);
-    item->product->discountA = ccpy(adjustedPset[4]);
-    if (item->product->discountTypeA != 0) item->product->discountAValue = atol(adjustedPset[4]);
+    item->product->discountTypeA = numberField('P', "P-5", record->discountType[0], UINT8_MAX);
+    item->product->discountA = ccpy(record->discount[0]);
+    if (item->product->discountTypeA != 0) item->product->discountAValue = numberField('P', "P-6", record->discount[0], INT64_MAX);
 
-    item->product->discountTypeB = atoi(adjustedPset[3]);
-    item->product->discountB = ccpy(adjustedPset[4]);
-    if (item->product->discountTypeB != 0) item->product->discountBValue = atol(adjustedPset[4]);
+    item->product->discountTypeB = numberField('P', "P-7", record->discountType[1], UINT8_MAX);
+    item->product->discountB = ccpy(record->discount[1]);
+    if (item->product->discountTypeB != 0) item->product->discountBValue = numberField('P', "P-8", record->discount[1], INT64_MAX);
 
-    item->product->discountTypeC = atoi(adjustedPset[3]);
-    item->product->discountC = ccpy(adjustedPset[4]);
-    if (item->product->discountTypeC != 0) item->product->discountCValue = atol(adjustedPset[4]);
+    item->product->discountTypeC = numberField('P', "P-9", record->discountType[2], UINT8_MAX);
+    item->product->discountC = ccpy(record->discount[2]);
+    if (item->product->discountTypeC != 0) item->product->discountCValue = numberField('P', "P-10", record->discount[2], INT64_MAX);
 }
 
-PList* check_Single_P_Set(char** pset, PList* pList) {
-    uint8_t found = 0;
-    PList* item = pList;
-    while (item != NULL) {
-        if (item->artNr == NULL) {
-            item = item->next;
-            continue;
-        }
-
-        if (strcmp(item->artNr, pset[0]) == 0) {
-            build_P_Product(item, pset, 0);
-            found = 1;
-            break;
-        }
-        item = item->next;
-    }
-    
-    if (found == 0) {
-        PList* newItem = malloc(sizeof(PList));
-        build_P_Product(newItem, pset, 1);
-        return newItem;
+// Cuts the field at *cursor off in place and moves *cursor to the next one
+char* nextField(char** cursor) {
+    char* field = *cursor;
+    char* end = strchr(field, ';');
+    if (end == NULL) {
+        *cursor = field + stringlength(field);
+    } else {
+        *end = '\0';
+        *cursor = end + 1;
     }
+    return field;
+}
 
-    return NULL;
+void decodePriceRecord(char** cursor, PriceRecord* record) {
+    record->artNr = nextField(cursor);
+    record->isPriceExclVAT = nextField(cursor);
+    record->price = nextField(cursor);
+    for (int d = 0; d < 3; d++) {
+        record->discountType[d] = nextField(cursor);
+        record->discount[d] = nextField(cursor);
+    }
 }
 
-PList* check_P_Set(char** line, PList* pList) {
-    char** pset = split(*line, ';');
+PList* check_P_Set(char** line, PList* pList, ProductIndex* index) {
+    size_t fieldCount = 1;
+    for (char* c = *line; *c != '\0'; c++) {
+        if (*c == ';') fieldCount++;
+    }
 
-    if (arraylength(pset) < 12) {
-        printf("PARSE ERROR %s\n", *line);
+    if (fieldCount < 12) {
+        reportError('P', "", "expected at least 12 fields");
         return NULL;
     }
-
-    pset += 2;
-    if (arraylength(pset) % 9 != 1) {
-        printf("P-PARSE ERROR (2) %s\n", *line);
+    if ((fieldCount - 2) % P_RECORD_FIELDS != 1) {
+        reportError('P', "", "incomplete price record");
         return NULL;
     }
 
+    if (index->dirty) {
+        rebuildIndex(index, pList);
+    }
+
+    char* cursor = *line;
+    nextField(&cursor); // P
+    nextField(&cursor); // A
+
     PList* newItems = NULL;
-    while (arraylength(pset) > 1 && arraylength(pset) % 9 == 1) {
-        PList* newItem = check_Single_P_Set(pset, pList);
-        if (newItem != NULL) {
-            if (newItems != NULL) {
-                newItem->next = newItems;
-            }
-            newItems = newItem;
+    size_t recordCount = (fieldCount - 2) / P_RECORD_FIELDS;
+    for (size_t r = 0; r < recordCount; r++) {
+        PriceRecord record;
+        decodePriceRecord(&cursor, &record);
+        if (stringlength(record.artNr) == 0) {
+            reportError('P', "P-2", "missing article number");
+            continue;
         }
 
-        pset += 9;
+        PList* item = findProduct(index, record.artNr);
+        if (item != NULL) {
+            build_P_Product(item, &record, 0);
+            continue;
+        }
+
+        PList* newItem = arenaAlloc(sizeof(PList));
+        build_P_Product(newItem, &record, 1);
+        // New items go in front of the list, so they shadow older ones just like the list order does
+        indexProduct(index, newItem, 1);
+        newItem->next = newItems;
+        newItems = newItem;
     }
 
     return newItems;
@@ -558,10 +881,15 @@ PList* check_R_Set(char** line, PList* pList) {
     char** rset = split(*line, ';');
 
     if (arraylength(rset) != 7) {
-        printf("R-PARSE ERROR %s\n", *line);
+        reportError('R', "", "expected 7 fields");
+        freeSet(rset);
+        free(rset);
         return NULL;
     }
 
+    uint8_t discountType = numberField('R', "R-3", rset[3], UINT8_MAX);
+    uint64_t discount = numberField('R', "R-4", rset[4], INT64_MAX);
+
     PList* item = pList;
     while (item != NULL) {
         if (item->product == NULL) {
@@ -570,20 +898,20 @@ PList* check_R_Set(char** line, PList* pList) {
         }
 
         if (strcmp(item->product->discountGroup, rset[2]) == 0) {
-            item->product->discountType = atoi(rset[3]);
-            item->product->discount = atol(rset[4]);
+            item->product->discountType = discountType;
+            item->product->discount = discount;
         }
         if (item->product->discountTypeA == 0 && strcmp(item->product->discountA, rset[2]) == 0) {
             item->product->discountA = ccpy(rset[4]);
-            item->product->discountAValue = atol(rset[4]);
+            item->product->discountAValue = discount;
         }
         if (item->product->discountTypeB == 0 && strcmp(item->product->discountB, rset[2]) == 0) {
             item->product->discountB = ccpy(rset[4]);
-            item->product->discountBValue = atol(rset[4]);
+            item->product->discountBValue = discount;
         }
         if (item->product->discountTypeC == 0 && strcmp(item->product->discountC, rset[2]) == 0) {
             item->product->discountC = ccpy(rset[4]);
-            item->product->discountCValue = atol(rset[4]);
+            item->product->discountCValue = discount;
         }
 
         item = item->next;
@@ -606,9 +934,9 @@ void build_B_Product(PList* item, char** bset) {
 
     item->product->matchcode = ccpy(bset[3]);
     item->product->alternativeArtNr = ccpy(bset[4]);
-    item->product->catalogPage = atoi(bset[5]);
-    item->product->cuIdentifier = atoi(bset[7]);
-    item->product->weight = atoi(bset[8]);
+    item->product->catalogPage = numberField('B', "B-5", bset[5], UINT32_MAX);
+    item->product->cuIdentifier = numberField('B', "B-7", bset[7], UINT16_MAX);
+    item->product->weight = numberField('B', "B-8", bset[8], UINT32_MAX);
     item->product->ean = ccpy(bset[9]);
 }
 
@@ -616,7 +944,9 @@ PList* check_B_Set(char** line, PList* pList) {
     char** bset = split(*line, ';');
 
     if (arraylength(bset) != 17) {
-        printf("B-PARSE ERROR %s\n", *line);
+        reportError('B', "", "expected 17 fields");
+        freeSet(bset);
+        free(bset);
         return NULL;
     }
 
@@ -629,123 +959,1283 @@ PList* check_B_Set(char** line, PList* pList) {
 
         if (strcmp(item->artNr, bset[2]) == 0) {
             build_B_Product(item, bset);
-            return NULL;
+            break;
         }
 
         item = item->next;
     }
+
+    freeSet(bset);
+    free(bset);
     return NULL;
 }
 
 /*
  File writings
 */
+static const char* outputColumns[] = {
+    "ArtNr", "Name", "Name2", "Langname", "Langname2", "Verarbeitungszeichen", "Preiskennzeichen",
+    "Preiseinheit", "Mengeneinheit", "Preis", "Rabattgruppe", "Artikelgruppe", "Langtextschlüssel",
+    "Matchcode", "Alternative ArtNr", "Katalogseite", "Kupfer-Kennzahl", "Kupfergewicht", "EAN",
+    "Rabatt", "RabattA", "RabattB", "RabattC",
+    "Zusatzinformationen",
+    NULL
+};
+
 char* parseString(char* str) {
     return str == NULL ? "" : str;
 }
 
-void writeToFile(PList* items) {
-    FILE* fp = fopen("output.txt", "w");
-    if (fp == NULL) {
-        exit(EXIT_FAILURE);
+// Formats into *buffer, growing it when needed. Returns the length or -1.
+int formatInto(char** buffer, size_t* cap, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(*buffer, *cap, format, args);
+    va_end(args);
+    if (len < 0) {
+        return -1;
+    }
+
+    if ((size_t) len >= *cap) {
+        char* grown = realloc(*buffer, len + 1);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buffer = grown;
+        *cap = len + 1;
+        va_start(args, format);
+        vsnprintf(*buffer, *cap, format, args);
+        va_end(args);
     }
+    return len;
+}
 
-    fprintf(fp, "%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s;%s\n",
-        "ArtNr", "Name", "Name2", "Langname", "Langname2", "Verarbeitungszeichen", "Preiskennzeichen",
-        "Preiseinheit", "Mengeneinheit", "Preis", "Rabattgruppe", "Artikelgruppe", "Langtextschlüssel",
-        "Matchcode", "Alternative ArtNr", "Katalogseite", "Kupfer-Kennzahl", "Kupfergewicht", "EAN",
-        "Rabatt", "RabattA", "RabattB", "RabattC",
-        "Zusatzinformationen");
+// Formats one output row into a buffer reused across rows. Returns the length or -1.
+int formatRow(PList* item, char** buffer, size_t* cap) {
+    return formatInto(buffer, cap, "%s;%s;%s;%s;%s;%s;%s;%d;%s;%ld;%s;%s;%s;%s;%s;%d;%d;%d;%s;%ld;%ld;%ld;%ld;%s\n",
+        parseString(item->artNr),
+        parseString(item->product->name1),
+        parseString(item->product->name2),
+        parseString(item->product->longName1),
+        parseString(item->product->longName2),
+        parseString(item->product->operationSign),
+        parseString(item->product->isPriceExclVAT),
+        item->product->priceMeasure,
+        parseString(item->product->measure),
+        item->product->price,
+        parseString(item->product->discountGroup),
+        parseString(item->product->articleGroup),
+        parseString(item->product->longTextKey),
+        parseString(item->product->matchcode),
+        parseString(item->product->alternativeArtNr),
+        item->product->catalogPage,
+        item->product->cuIdentifier,
+        item->product->weight,
+        parseString(item->product->ean),
+        item->product->discount,
+        item->product->discountAValue,
+        item->product->discountBValue,
+        item->product->discountCValue,
+        parseString(item->product->longTexts));
+}
+
+void writeHeader(FILE* fp) {
+    for (size_t i = 0; outputColumns[i] != NULL; i++) {
+        fprintf(fp, i == 0 ? "%s" : ";%s", outputColumns[i]);
+    }
+    fputc('\n', fp);
+}
+
+static const uint8_t numericColumns[] = {
+    0, 0, 0, 0, 0, 0, 0,
+    1, 0, 1, 0, 0, 0,
+    0, 0, 1, 1, 1, 0,
+    1, 1, 1, 1,
+    0
+};
+
+int findColumn(const char* name) {
+    for (int i = 0; outputColumns[i] != NULL; i++) {
+        if (strcasecmp(outputColumns[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+
+/*
+ Sorted output
+ Rows are formatted and collected until the memory budget is exceeded, then the
+ run is sorted and spilled to a temporary file. All runs are k-way merged at the end.
+*/
+#define MERGE_FAN_IN 256 // Runs merged at once, bounds the number of open temporary files
+
+typedef struct SortOptions {
+    int column; // Index into outputColumns, -1 = unsorted
+    uint8_t numeric; // Column holds numbers and is compared by value
+    size_t memoryBudget; // Bytes of formatted rows kept in memory before spilling a run
+} SortOptions;
+
+typedef struct SortRow {
+    char* row;
+    const char* key;
+    size_t keyLen;
+} SortRow;
+
+typedef struct MergeSource {
+    FILE* fp;
+    SortRow current;
+    size_t cap;
+    size_t run; // Tie breaker for identical rows
+} MergeSource;
+
+void extractKey(SortRow* row, int column) {
+    const char* start = row->row;
+    for (int i = 0; i < column && *start != '\0'; i++) {
+        start = strchr(start, ';');
+        if (start == NULL) {
+            row->key = "";
+            row->keyLen = 0;
+            return;
+        }
+        start++;
+    }
+    row->key = start;
+    row->keyLen = strcspn(start, ";\n");
+}
+
+// Numeric columns (prices, weights, ...) are compared by value, text columns bytewise
+int compareKeys(const SortRow* a, const SortRow* b, uint8_t numeric) {
+    const char* ka = a->key;
+    const char* kb = b->key;
+    size_t la = a->keyLen;
+    size_t lb = b->keyLen;
+
+    if (numeric) {
+        while (la > 1 && *ka == '0') { ka++; la--; }
+        while (lb > 1 && *kb == '0') { kb++; lb--; }
+        if (la != lb) return la < lb ? -1 : 1;
+        return memcmp(ka, kb, la);
+    }
+
+    int cmp = memcmp(ka, kb, la < lb ? la : lb);
+    if (cmp != 0) return cmp;
+    if (la != lb) return la < lb ? -1 : 1;
+    return 0;
+}
+
+int compareRows(const SortRow* a, const SortRow* b, uint8_t numeric) {
+    int cmp = compareKeys(a, b, numeric);
+    if (cmp != 0) return cmp;
+    // qsort is not stable, fall back to the whole row to keep the output deterministic
+    return strcmp(a->row, b->row);
+}
+
+int compareTextRows(const void* a, const void* b) {
+    return compareRows(a, b, 0);
+}
+
+int compareNumericRows(const void* a, const void* b) {
+    return compareRows(a, b, 1);
+}
+
+void sortRows(SortRow* rows, size_t count, SortOptions* sortOptions) {
+    qsort(rows, count, sizeof(SortRow), sortOptions->numeric ? compareNumericRows : compareTextRows);
+}
+
+// Returns NULL if the run cannot be written completely, the rows are left untouched
+FILE* spillRun(SortRow* rows, size_t count) {
+    FILE* run = tmpfile();
+    if (run == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        fputs(rows[i].row, run);
+    }
+    // rewind clears the error indicator, so check before
+    if (fflush(run) != 0 || ferror(run)) {
+        fclose(run);
+        return NULL;
+    }
+    rewind(run);
+    return run;
+}
+
+// Returns 1 for a row, 0 at the end of the run and -1 on a read error
+int readMergeSource(MergeSource* source, int column) {
+    if (getline(&source->current.row, &source->cap, source->fp) == -1) {
+        return ferror(source->fp) ? -1 : 0;
+    }
+    extractKey(&source->current, column);
+    return 1;
+}
+
+int compareSources(MergeSource* a, MergeSource* b, uint8_t numeric) {
+    int cmp = compareRows(&a->current, &b->current, numeric);
+    if (cmp != 0) return cmp;
+    return a->run < b->run ? -1 : 1;
+}
+
+void siftDown(MergeSource** heap, size_t size, size_t i, uint8_t numeric) {
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        if (left < size && compareSources(heap[left], heap[smallest], numeric) < 0) smallest = left;
+        if (right < size && compareSources(heap[right], heap[smallest], numeric) < 0) smallest = right;
+        if (smallest == i) return;
+
+        MergeSource* tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Merges and closes all runs. Returns -1 if a run cannot be read or fp cannot be written.
+int mergeRuns(FILE* fp, FILE** runs, size_t runCount, SortOptions* sortOptions) {
+    MergeSource* sources = calloc(runCount, sizeof(MergeSource));
+    MergeSource** heap = malloc(runCount * sizeof(MergeSource*));
+    size_t heapSize = 0;
+    int status = sources == NULL || heap == NULL ? -1 : 0;
+
+    for (size_t i = 0; i < runCount && status == 0; i++) {
+        sources[i].fp = runs[i];
+        sources[i].run = i;
+        int read = readMergeSource(&sources[i], sortOptions->column);
+        if (read < 0) {
+            status = -1;
+        } else if (read > 0) {
+            heap[heapSize++] = &sources[i];
+        }
+    }
+    for (size_t i = heapSize / 2; i-- > 0;) {
+        siftDown(heap, heapSize, i, sortOptions->numeric);
+    }
+
+    while (heapSize > 0 && status == 0) {
+        fputs(heap[0]->current.row, fp);
+        int read = readMergeSource(heap[0], sortOptions->column);
+        if (read < 0) {
+            status = -1;
+        } else if (read == 0) {
+            heap[0] = heap[--heapSize];
+        }
+        siftDown(heap, heapSize, 0, sortOptions->numeric);
+    }
+
+    for (size_t i = 0; i < runCount; i++) {
+        if (sources != NULL) free(sources[i].current.row);
+        fclose(runs[i]);
+    }
+    free(sources);
+    free(heap);
+    return status == 0 && !ferror(fp) ? 0 : -1;
+}
+
+// Merges all runs into a single new run, so no more than MERGE_FAN_IN are ever open.
+// The runs are closed afterwards, even if merging fails. Returns NULL on failure.
+FILE* collapseRuns(FILE** runs, size_t* runCount, SortOptions* sortOptions) {
+    FILE* merged = tmpfile();
+    if (merged == NULL) {
+        for (size_t i = 0; i < *runCount; i++) {
+            fclose(runs[i]);
+        }
+        *runCount = 0;
+        return NULL;
+    }
+
+    int status = mergeRuns(merged, runs, *runCount, sortOptions);
+    *runCount = 0;
+    if (status != 0 || fflush(merged) != 0 || ferror(merged)) {
+        fclose(merged);
+        return NULL;
+    }
+    rewind(merged);
+    return merged;
+}
+
+// Spills the sorted rows as a new run, merging the open runs first when MERGE_FAN_IN is reached.
+// The rows are freed once they are on disk.
+int addRun(FILE** runs, size_t* runCount, SortRow* rows, size_t rowCount, SortOptions* sortOptions) {
+    if (*runCount == MERGE_FAN_IN) {
+        FILE* merged = collapseRuns(runs, runCount, sortOptions);
+        if (merged == NULL) return -1;
+        runs[(*runCount)++] = merged;
+    }
+
+    FILE* run = spillRun(rows, rowCount);
+    if (run == NULL) return -1;
+    runs[(*runCount)++] = run;
+    for (size_t i = 0; i < rowCount; i++) {
+        free(rows[i].row);
+    }
+    return 0;
+}
+
+// Returns -1 if a row cannot be formatted or a run cannot be spilled to or read from disk
+int writeSorted(FILE* fp, PList* items, SortOptions* sortOptions) {
+    size_t rowCap = 1024;
+    size_t rowCount = 0;
+    size_t bytesUsed = 0;
+    SortRow* rows = malloc(rowCap * sizeof(SortRow));
+    char* buffer = NULL;
+    size_t bufferCap = 0;
+
+    size_t runCount = 0;
+    FILE* runs[MERGE_FAN_IN];
+    int status = rows == NULL ? -1 : 0;
 
     PList* item = items;
-    while (item != NULL) {
+    while (item != NULL && status == 0) {
         if (item->product == NULL) {
             item = item->next;
             continue;
         }
 
-        fprintf(fp, "%s;%s;%s;%s;%s;%s;%s;%d;%s;%ld;%s;%s;%s;%s;%s;%d;%d;%d;%s;%ld;%ld;%ld;%ld;%s\n",
-            parseString(item->artNr),
-            parseString(item->product->name1),
-            parseString(item->product->name2),
-            parseString(item->product->longName1),
-            parseString(item->product->longName2),
-            parseString(item->product->operationSign),
-            parseString(item->product->isPriceExclVAT),
-            item->product->priceMeasure,
-            parseString(item->product->measure),
-            item->product->price,
-            parseString(item->product->discountGroup),
-            parseString(item->product->articleGroup),
-            parseString(item->product->longTextKey),
-            parseString(item->product->matchcode),
-            parseString(item->product->alternativeArtNr),
-            item->product->catalogPage,
-            item->product->cuIdentifier,
-            item->product->weight,
-            parseString(item->product->ean),
-            item->product->discount,
-            item->product->discountAValue,
-            item->product->discountBValue,
-            item->product->discountCValue,
-            parseString(item->product->longTexts));
+        if (rowCount == rowCap) {
+            SortRow* grown = realloc(rows, rowCap * 2 * sizeof(SortRow));
+            if (grown == NULL) {
+                status = -1;
+                break;
+            }
+            rows = grown;
+            rowCap *= 2;
+        }
+
+        int len = formatRow(item, &buffer, &bufferCap);
+        char* copy = len < 0 ? NULL : malloc(len + 1);
+        if (copy == NULL) {
+            status = -1;
+            break;
+        }
+        memcpy(copy, buffer, len + 1);
+
+        SortRow* row = &rows[rowCount++];
+        row->row = copy;
+        extractKey(row, sortOptions->column);
+        bytesUsed += len + 1 + sizeof(SortRow);
+
+        if (bytesUsed > sortOptions->memoryBudget) {
+            sortRows(rows, rowCount, sortOptions);
+            status = addRun(runs, &runCount, rows, rowCount, sortOptions);
+            if (status == 0) {
+                rowCount = 0;
+                bytesUsed = 0;
+            }
+        }
         item = item->next;
     }
+    free(buffer);
+
+    if (status == 0) {
+        sortRows(rows, rowCount, sortOptions);
+        if (runCount > 0 && rowCount > 0) {
+            status = addRun(runs, &runCount, rows, rowCount, sortOptions);
+            if (status == 0) rowCount = 0;
+        }
+    }
 
+    if (status != 0) {
+        for (size_t i = 0; i < rowCount; i++) {
+            free(rows[i].row);
+        }
+        for (size_t i = 0; i < runCount; i++) {
+            fclose(runs[i]);
+        }
+    } else if (runCount == 0) {
+        // Everything fit into the budget, no need to touch the disk
+        for (size_t i = 0; i < rowCount; i++) {
+            fputs(rows[i].row, fp);
+            free(rows[i].row);
+        }
+    } else {
+        status = mergeRuns(fp, runs, runCount, sortOptions);
+    }
+
+    free(rows);
+    return status;
+}
+
+// Writes to a temporary file next to path first, so a failed run never leaves a truncated output
+int writeToFile(PList* items, const char* path, SortOptions* sortOptions) {
+    char* tmpPath = formatString("%s.%ld.tmp", path, (long) getpid());
+    FILE* fp = fopen(tmpPath, "w");
+    if (fp == NULL) {
+        free(tmpPath);
+        return -1;
+    }
+
+    writeHeader(fp);
+
+    int status = 0;
+    if (sortOptions->column >= 0) {
+        status = writeSorted(fp, items, sortOptions);
+    } else {
+        char* buffer = NULL;
+        size_t bufferCap = 0;
+        PList* item = items;
+        while (item != NULL && status == 0) {
+            if (item->product == NULL) {
+                item = item->next;
+                continue;
+            }
+
+            int len = formatRow(item, &buffer, &bufferCap);
+            if (len < 0) {
+                status = -1;
+            } else {
+                fwrite(buffer, 1, len, fp);
+            }
+            item = item->next;
+        }
+        free(buffer);
+    }
+
+    if (ferror(fp)) {
+        status = -1;
+    }
+    if (fclose(fp) != 0) {
+        status = -1;
+    }
+    if (status == 0) {
+        status = rename(tmpPath, path);
+    }
+    if (status != 0) {
+        remove(tmpPath);
+    }
+    free(tmpPath);
+    return status;
+}
+
+
+
+/*
+ Fingerprint cache
+ Sets of later files update products of earlier ones, so a file's contribution
+ depends on everything parsed before it. The cache therefore stores the product
+ list after each file, keyed by the output and the fingerprints of that file and
+ all files before it. A run restores the longest unchanged prefix and only parses
+ the rest. Keying by output keeps every snapshot owned by a single output, so
+ evicting an output's stale snapshots never hits another one.
+*/
+#define CACHE_MAGIC "DNC3"
+// Part of every fingerprint. Bump whenever a parser change alters the parsed result,
+// snapshots of older versions are then never restored.
+#define PARSER_VERSION 2
+
+uint64_t fingerprintSeed(const char* output) {
+    uint64_t version = PARSER_VERSION;
+    uint64_t hash = fnv1a(FNV_OFFSET, CACHE_MAGIC, 4);
+    hash = fnv1a(hash, &version, sizeof(version));
+    return fnv1a(hash, output, stringlength(output) + 1);
+}
+// Chains the content hash of path onto hash. Returns -1 if the file cannot be read.
+int fingerprintFile(const char* path, uint64_t* hash) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    unsigned char buffer[1 << 16];
+    uint64_t content = FNV_OFFSET;
+    uint64_t size = 0;
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        content = fnv1a(content, buffer, read);
+        size += read;
+    }
     fclose(fp);
+
+    *hash = fnv1a(*hash, &content, sizeof(content));
+    *hash = fnv1a(*hash, &size, sizeof(size));
+    return 0;
 }
 
-int main(int argc, char* argv[]) {
-    PList* pList = malloc(sizeof(PList));
-    pList->next = NULL;
-    pList->product = NULL;
+char* cachePath(const char* cacheDir, uint64_t fingerprint) {
+    return formatString("%s/%016llx.dnc", cacheDir, (unsigned long long) fingerprint);
+}
 
-    for (int i = 1; i < argc; i++) {
-        FILE* fp = fopen(argv[i], "r");
-        if (fp == NULL) {
-            exit(EXIT_FAILURE);
+void writeCacheNumber(FILE* fp, uint64_t value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+void writeCacheString(FILE* fp, const char* str) {
+    uint32_t len = str == NULL ? UINT32_MAX : stringlength(str);
+    fwrite(&len, sizeof(len), 1, fp);
+    if (str != NULL) fwrite(str, 1, len, fp);
+}
+
+// Lengths read from a snapshot are checked against what is left of the file,
+// so a corrupt snapshot is a cache miss instead of a huge allocation
+typedef struct CacheReader {
+    FILE* fp;
+    uint64_t remaining;
+} CacheReader;
+
+uint8_t readCacheBytes(CacheReader* reader, void* data, uint64_t size) {
+    if (size > reader->remaining || fread(data, 1, size, reader->fp) != size) return 0;
+    reader->remaining -= size;
+    return 1;
+}
+
+uint8_t readCacheNumber(CacheReader* reader, uint64_t* value) {
+    return readCacheBytes(reader, value, sizeof(*value));
+}
+
+uint8_t readCacheString(CacheReader* reader, char** str) {
+    uint32_t len;
+    if (!readCacheBytes(reader, &len, sizeof(len))) return 0;
+    if (len == UINT32_MAX) {
+        *str = NULL;
+        return 1;
+    }
+    if (len > reader->remaining) return 0;
+
+    *str = arenaAlloc(len + 1);
+    if (!readCacheBytes(reader, *str, len)) return 0;
+    (*str)[len] = '\0';
+    return 1;
+}
+
+void writeCachedProduct(FILE* fp, Product* product) {
+    writeCacheString(fp, product->artNr);
+    writeCacheString(fp, product->name1);
+    writeCacheString(fp, product->name2);
+    writeCacheString(fp, product->longName1);
+    writeCacheString(fp, product->longName2);
+    writeCacheString(fp, product->operationSign);
+    writeCacheString(fp, product->isPriceExclVAT);
+    writeCacheNumber(fp, product->priceMeasure);
+    writeCacheString(fp, product->measure);
+    writeCacheNumber(fp, product->price);
+    writeCacheString(fp, product->discountGroup);
+    writeCacheNumber(fp, product->discountType);
+    writeCacheNumber(fp, product->discount);
+    writeCacheString(fp, product->articleGroup);
+    writeCacheString(fp, product->longTextKey);
+    writeCacheString(fp, product->matchcode);
+    writeCacheString(fp, product->alternativeArtNr);
+    writeCacheNumber(fp, product->catalogPage);
+    writeCacheNumber(fp, product->cuIdentifier);
+    writeCacheNumber(fp, product->weight);
+    writeCacheString(fp, product->ean);
+    writeCacheString(fp, product->longTexts);
+    writeCacheNumber(fp, product->discountTypeA);
+    writeCacheString(fp, product->discountA);
+    writeCacheNumber(fp, product->discountAValue);
+    writeCacheNumber(fp, product->discountTypeB);
+    writeCacheString(fp, product->discountB);
+    writeCacheNumber(fp, product->discountBValue);
+    writeCacheNumber(fp, product->discountTypeC);
+    writeCacheString(fp, product->discountC);
+    writeCacheNumber(fp, product->discountCValue);
+}
+
+uint8_t readCachedProduct(CacheReader* reader, Product* product) {
+    uint64_t n[15];
+    uint8_t ok = readCacheString(reader, &product->artNr)
+        && readCacheString(reader, &product->name1)
+        && readCacheString(reader, &product->name2)
+        && readCacheString(reader, &product->longName1)
+        && readCacheString(reader, &product->longName2)
+        && readCacheString(reader, &product->operationSign)
+        && readCacheString(reader, &product->isPriceExclVAT)
+        && readCacheNumber(reader, &n[0])
+        && readCacheString(reader, &product->measure)
+        && readCacheNumber(reader, &n[1])
+        && readCacheString(reader, &product->discountGroup)
+        && readCacheNumber(reader, &n[2])
+        && readCacheNumber(reader, &n[3])
+        && readCacheString(reader, &product->articleGroup)
+        && readCacheString(reader, &product->longTextKey)
+        && readCacheString(reader, &product->matchcode)
+        && readCacheString(reader, &product->alternativeArtNr)
+        && readCacheNumber(reader, &n[4])
+        && readCacheNumber(reader, &n[5])
+        && readCacheNumber(reader, &n[6])
+        && readCacheString(reader, &product->ean)
+        && readCacheString(reader, &product->longTexts)
+        && readCacheNumber(reader, &n[7])
+        && readCacheString(reader, &product->discountA)
+        && readCacheNumber(reader, &n[8])
+        && readCacheNumber(reader, &n[9])
+        && readCacheString(reader, &product->discountB)
+        && readCacheNumber(reader, &n[10])
+        && readCacheNumber(reader, &n[11])
+        && readCacheString(reader, &product->discountC)
+        && readCacheNumber(reader, &n[12]);
+    if (!ok) return 0;
+
+    product->priceMeasure = n[0];
+    product->price = n[1];
+    product->discountType = n[2];
+    product->discount = n[3];
+    product->catalogPage = n[4];
+    product->cuIdentifier = n[5];
+    product->weight = n[6];
+    product->discountTypeA = n[7];
+    product->discountAValue = n[8];
+    product->discountTypeB = n[9];
+    product->discountBValue = n[10];
+    product->discountTypeC = n[11];
+    product->discountCValue = n[12];
+    return 1;
+}
+
+// Stores the error entries reported so far with the snapshot, so they can be replayed on restore
+void writeCachedErrors(FILE* fp, ErrorLog* log) {
+    writeCacheNumber(fp, log->lines);
+    writeCacheNumber(fp, log->entriesSize);
+    fwrite(log->entries, 1, log->entriesSize, fp);
+}
+
+// Writes to a temporary file first, concurrent batch workers may store the same snapshot
+void saveSnapshot(const char* cacheDir, uint64_t fingerprint, PList* pList, ErrorLog* log) {
+    char* path = cachePath(cacheDir, fingerprint);
+    char* tmpPath = formatString("%s.%ld.%lx.tmp", path, (long) getpid(), (unsigned long) pthread_self());
+
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        free(path);
+        free(tmpPath);
+        return;
+    }
+
+    uint64_t count = 0;
+    for (PList* item = pList; item != NULL; item = item->next) {
+        count++;
+    }
+
+    fwrite(CACHE_MAGIC, 1, 4, fp);
+    writeCachedErrors(fp, log);
+    writeCacheNumber(fp, count);
+    for (PList* item = pList; item != NULL; item = item->next) {
+        writeCacheString(fp, item->artNr);
+        writeCacheString(fp, item->longTextKey);
+        fputc(item->product != NULL, fp);
+        if (item->product != NULL) {
+            writeCachedProduct(fp, item->product);
         }
+    }
 
-        char* line = NULL;
-        size_t len = 0;
-        while (getline(&line, &len, fp) != -1) {
-            escapeSpecialChars(&line, len);
-
-            char setId = line[0];
-            PList* newlyCreated = NULL;
-            if (setId == 'T') {
-                newlyCreated = check_T_Set(&line, pList);
-            } else if (setId == 'A') {
-                newlyCreated = check_A_Set(&line, pList);
-            } else if (setId == 'P') {
-                newlyCreated = check_P_Set(&line, pList);
-            } else if (setId == 'R') {
-                check_R_Set(&line, pList);
-            } else if (setId == 'B') {
-                check_B_Set(&line, pList);
-            }
+    if (fclose(fp) == 0) {
+        rename(tmpPath, path);
+    } else {
+        remove(tmpPath);
+    }
+    free(path);
+    free(tmpPath);
+}
 
-            if (newlyCreated != NULL) {
-                if (newlyCreated->next == NULL) {
-                    newlyCreated->next = pList;
-                    pList = newlyCreated;
-                } else {
-                    PList* lastOfNew = newlyCreated->next;
-                    while (lastOfNew->next != NULL) {
-                        lastOfNew = lastOfNew->next;
-                    }
-                    lastOfNew->next = pList;
-                    pList = newlyCreated;
-                }
+// Reads the error entries and product list of a snapshot. Returns NULL if it is not intact.
+PList* readSnapshot(CacheReader* reader, uint64_t* errorLines, char** errors, uint64_t* errorSize) {
+    char magic[4];
+    uint64_t count;
+    if (!readCacheBytes(reader, magic, 4) || memcmp(magic, CACHE_MAGIC, 4) != 0
+        || !readCacheNumber(reader, errorLines) || !readCacheNumber(reader, errorSize)
+        || *errorSize > reader->remaining) {
+        return NULL;
+    }
+
+    *errors = arenaAlloc(*errorSize);
+    if (!readCacheBytes(reader, *errors, *errorSize) || !readCacheNumber(reader, &count)) {
+        return NULL;
+    }
+
+    PList* head = NULL;
+    PList* tail = NULL;
+    for (uint64_t i = 0; i < count; i++) {
+        PList* item = arenaAlloc(sizeof(PList));
+        item->next = NULL;
+        item->product = NULL;
+
+        unsigned char hasProduct;
+        if (!readCacheString(reader, &item->artNr) || !readCacheString(reader, &item->longTextKey)
+            || !readCacheBytes(reader, &hasProduct, 1)) {
+            return NULL;
+        }
+        if (hasProduct) {
+            item->product = arenaAlloc(sizeof(Product));
+            if (!readCachedProduct(reader, item->product)) {
+                return NULL;
             }
+        }
 
-            free(line);
-            len = 0;
+        if (tail == NULL) {
+            head = item;
+        } else {
+            tail->next = item;
         }
+        tail = item;
+    }
+    return head;
+}
 
+// Parses the file index in front of a stored error entry. Returns -1 if it is malformed.
+long entryFileIndex(const char* entry, const char* end, size_t fileCount, const char** rest) {
+    size_t index = 0;
+    const char* c = entry;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        index = index * 10 + (*c - '0');
+        if (index >= fileCount) return -1;
+    }
+    if (c == entry || c == end || *c != ';') return -1;
+    *rest = c;
+    return (long) index;
+}
+
+// Returns 0 if every entry refers to one of the first fileCount files
+int checkCachedErrors(const char* entries, uint64_t size, size_t fileCount) {
+    const char* entry = entries;
+    const char* last = entries + size;
+    while (entry < last) {
+        const char* end = memchr(entry, '\n', last - entry);
+        const char* rest;
+        if (end == NULL || entryFileIndex(entry, end, fileCount, &rest) < 0) return -1;
+        entry = end + 1;
+    }
+    return 0;
+}
+
+// Writes restored entries to the sidecar with the paths of this run and keeps them for later snapshots
+void replayCachedErrors(ErrorLog* log, char** files, const char* entries, uint64_t size, uint64_t lines) {
+    log->lines = lines;
+    appendEntries(log, entries, size);
+    if (size == 0 || openErrorLog(log, 1) != 0) {
+        return;
+    }
+
+    const char* entry = entries;
+    const char* last = entries + size;
+    while (entry < last) {
+        const char* end = memchr(entry, '\n', last - entry);
+        const char* rest;
+        long index = entryFileIndex(entry, end, SIZE_MAX, &rest);
+        fputs(files[index], log->fp);
+        fwrite(rest, 1, end + 1 - rest, log->fp);
+        entry = end + 1;
+    }
+}
+
+// Returns the cached product list or NULL if there is no (intact) snapshot.
+// The error entries stored with it are replayed into log, for the first fileCount files.
+// The snapshot is opened as *input, so it is closed if an allocation fails while it is read.
+PList* loadSnapshot(const char* cacheDir, uint64_t fingerprint, ErrorLog* log, char** files, size_t fileCount, FILE** input) {
+    char* path = cachePath(cacheDir, fingerprint);
+    FILE* fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
         fclose(fp);
-        if (line) free(line);
+        return NULL;
     }
-    
-    writeToFile(pList);
+    *input = fp;
+
+    CacheReader reader = { fp, st.st_size };
+    uint64_t errorLines;
+    uint64_t errorSize;
+    char* errors;
+    PList* head = readSnapshot(&reader, &errorLines, &errors, &errorSize);
+    fclose(fp);
+    *input = NULL;
+
+    if (head == NULL || checkCachedErrors(errors, errorSize, fileCount) != 0) {
+        return NULL;
+    }
+    replayCachedErrors(log, files, errors, errorSize, errorLines);
+    return head;
+}
+
+// Remembers the snapshots of the current inputs per output and deletes the ones left from earlier runs
+void updateCacheChain(const char* cacheDir, const char* output, uint64_t* fingerprints, size_t count) {
+    char* path = formatString("%s/%016llx.chain", cacheDir,
+        (unsigned long long) fnv1a(FNV_OFFSET, output, stringlength(output)));
+
+    FILE* fp = fopen(path, "r");
+    if (fp != NULL) {
+        unsigned long long old;
+        while (fscanf(fp, "%llx", &old) == 1) {
+            uint8_t current = 0;
+            for (size_t i = 0; i < count && !current; i++) {
+                current = fingerprints[i] == old;
+            }
+            if (!current) {
+                char* snapshot = cachePath(cacheDir, old);
+                remove(snapshot);
+                free(snapshot);
+            }
+        }
+        fclose(fp);
+    }
+
+    char* tmpPath = formatString("%s.%ld.%lx.tmp", path, (long) getpid(), (unsigned long) pthread_self());
+    fp = fopen(tmpPath, "w");
+    if (fp != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            fprintf(fp, "%016llx\n", (unsigned long long) fingerprints[i]);
+        }
+        if (fclose(fp) == 0) {
+            rename(tmpPath, path);
+        } else {
+            remove(tmpPath);
+        }
+    }
+    free(tmpPath);
+    free(path);
+}
+
+
+
+/*
+ File parsing
+*/
+// State of one supplier, kept outside the stack so it can be cleaned up after an allocation failure
+typedef struct ParseJob {
+    PList* pList;
+    ProductIndex index;
+    uint64_t* fingerprints;
+    FILE* input; // Input file currently parsed
+    char* line; // Line currently parsed
+    ErrorLog log;
+} ParseJob;
+
+int parseFile(ParseJob* job, const char* path) {
+    job->input = fopen(path, "r");
+    if (job->input == NULL) {
+        return -1;
+    }
+
+    job->log.file = path;
+    job->log.line = 0;
+
+    size_t len = 0;
+    ssize_t read;
+    while ((read = getline(&job->line, &len, job->input)) != -1) {
+        job->log.line++;
+        char* rawLine = job->line;
+        escapeSpecialChars(&job->line, read);
+        free(rawLine);
+
+        char setId = job->line[0];
+        PList* newlyCreated = NULL;
+        if (setId == 'T') {
+            newlyCreated = check_T_Set(&job->line, job->pList);
+        } else if (setId == 'A') {
+            newlyCreated = check_A_Set(&job->line, job->pList, &job->index);
+        } else if (setId == 'P') {
+            newlyCreated = check_P_Set(&job->line, job->pList, &job->index);
+        } else if (setId == 'R') {
+            check_R_Set(&job->line, job->pList);
+        } else if (setId == 'B') {
+            check_B_Set(&job->line, job->pList);
+        }
+
+        if (newlyCreated != NULL) {
+            PList* lastOfNew = newlyCreated;
+            while (lastOfNew->next != NULL) {
+                lastOfNew = lastOfNew->next;
+            }
+            lastOfNew->next = job->pList;
+            job->pList = newlyCreated;
+        }
+
+        free(job->line);
+        job->line = NULL;
+        len = 0;
+    }
+
+    fclose(job->input);
+    job->input = NULL;
+    free(job->line);
+    job->line = NULL;
+    return 0;
+}
+
+// output.txt -> output.errors.txt
+char* errorLogPath(const char* output) {
+    const char* slash = strrchr(output, '/');
+    const char* dot = strrchr(output, '.');
+    if (dot == NULL || (slash != NULL && dot < slash)) {
+        return formatString("%s.errors", output);
+    }
+    return formatString("%.*s.errors%s", (int) (dot - output), output, dot);
+}
+
+const char* parseAndWrite(ParseJob* job, char** files, size_t fileCount, const char* output, SortOptions* sortOptions, const char* cacheDir) {
+    job->pList = arenaAlloc(sizeof(PList));
+    job->pList->artNr = NULL;
+    job->pList->longTextKey = NULL;
+    job->pList->next = NULL;
+    job->pList->product = NULL;
+    job->index.dirty = 1;
+
+    size_t firstToParse = 0;
+    if (cacheDir != NULL) {
+        job->log.keepEntries = 1;
+        job->fingerprints = checkAlloc(malloc(fileCount * sizeof(uint64_t)));
+        uint64_t hash = fingerprintSeed(output);
+        for (size_t i = 0; i < fileCount; i++) {
+            if (fingerprintFile(files[i], &hash) != 0) {
+                updateCacheChain(cacheDir, output, job->fingerprints, i);
+                return files[i];
+            }
+            job->fingerprints[i] = hash;
+        }
+        updateCacheChain(cacheDir, output, job->fingerprints, fileCount);
+
+        for (size_t i = fileCount; i > 0; i--) {
+            PList* cached = loadSnapshot(cacheDir, job->fingerprints[i - 1], &job->log, files, i, &job->input);
+            if (cached != NULL) {
+                job->pList = cached;
+                firstToParse = i;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = firstToParse; i < fileCount; i++) {
+        job->log.fileIndex = i;
+        if (parseFile(job, files[i]) != 0) {
+            return files[i];
+        }
+        if (job->fingerprints != NULL) {
+            saveSnapshot(cacheDir, job->fingerprints[i], job->pList, &job->log);
+        }
+    }
+
+    if (writeToFile(job->pList, output, sortOptions) != 0) {
+        return output;
+    }
+    return NULL;
+}
+
+// Parses the files of one supplier in order and writes them to output. Returns what failed or NULL.
+const char* processFiles(char** files, size_t fileCount, const char* output, SortOptions* sortOptions, const char* cacheDir) {
+    ParseJob* job = calloc(1, sizeof(ParseJob));
+    if (job == NULL) {
+        return "memory allocation";
+    }
+    job->log.file = "";
+    errorLog = &job->log;
+
+    jmp_buf failure;
+    const char* failed;
+    if (setjmp(failure) == 0) {
+        arenaFailure = &failure;
+        job->log.path = errorLogPath(output);
+        // Do not leave a stale sidecar from an earlier run next to a clean output
+        remove(job->log.path);
+        failed = parseAndWrite(job, files, fileCount, output, sortOptions, cacheDir);
+    } else {
+        failed = "memory allocation";
+    }
+    arenaFailure = NULL;
+
+    if (job->input != NULL) fclose(job->input);
+    free(job->line);
+    free(job->fingerprints);
+    free(job->index.slots);
+    arenaRelease();
+
+    errorLog = NULL;
+    if (job->log.fp != NULL) {
+        fclose(job->log.fp);
+        fprintf(stderr, "%s: %zu malformed lines, see %s\n", output, job->log.lines, job->log.path);
+    }
+    free(job->log.path);
+    free(job->log.entries);
+    free(job);
+    return failed;
+}
+
+
+
+/*
+ Batch mode
+ Every manifest line is one supplier: output;file1;file2;...
+ Suppliers are dealt to per-worker deques, largest first. A worker pops its own
+ deque from the back and steals from the front of the others once it runs dry.
+*/
+typedef struct BatchJob {
+    char** fields; // [0] = output, [1..] = input files in parse order
+    size_t fileCount;
+    uint64_t cost; // Total input size in bytes
+    const char* failed;
+} BatchJob;
+
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    BatchJob** jobs;
+    size_t head;
+    size_t tail;
+} WorkQueue;
+
+typedef struct Worker {
+    pthread_t thread;
+    size_t id;
+    size_t workerCount;
+    WorkQueue* queues;
+    SortOptions* sortOptions;
+    const char* cacheDir;
+} Worker;
+
+BatchJob* popJob(WorkQueue* queue) {
+    BatchJob* job = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        job = queue->jobs[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+BatchJob* stealJob(WorkQueue* queue) {
+    BatchJob* job = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        job = queue->jobs[queue->head++];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+void* runWorker(void* arg) {
+    Worker* worker = arg;
+
+    while (1) {
+        BatchJob* job = popJob(&worker->queues[worker->id]);
+        // Jobs never spawn new jobs, so once every queue is empty we are done
+        for (size_t i = 1; job == NULL && i < worker->workerCount; i++) {
+            job = stealJob(&worker->queues[(worker->id + i) % worker->workerCount]);
+        }
+        if (job == NULL) {
+            return NULL;
+        }
+
+        job->failed = processFiles(job->fields + 1, job->fileCount, job->fields[0], worker->sortOptions, worker->cacheDir);
+    }
+}
+
+int compareJobCost(const void* a, const void* b) {
+    const BatchJob* ja = *(BatchJob* const*) a;
+    const BatchJob* jb = *(BatchJob* const*) b;
+    return ja->cost < jb->cost ? 1 : (ja->cost > jb->cost ? -1 : 0);
+}
+
+BatchJob** readManifest(const char* path, size_t* jobCount) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    size_t cap = 16;
+    BatchJob** jobs = checkAlloc(malloc(cap * sizeof(BatchJob*)));
+    *jobCount = 0;
+
+    char* line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, fp) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        char** fields = split(line, ';');
+        size_t fieldCount = arraylength(fields);
+        if (fieldCount < 2) {
+            fprintf(stderr, "Manifest line without input files: %s\n", line);
+            freeSet(fields);
+            free(fields);
+            continue;
+        }
+
+        uint8_t duplicate = 0;
+        for (size_t j = 0; j < *jobCount && !duplicate; j++) {
+            duplicate = strcmp(jobs[j]->fields[0], fields[0]) == 0;
+        }
+        if (duplicate) {
+            // Both suppliers would write the same temporary file and sidecar
+            fprintf(stderr, "Manifest lists output %s more than once\n", fields[0]);
+            freeSet(fields);
+            free(fields);
+            for (size_t j = 0; j < *jobCount; j++) {
+                freeSet(jobs[j]->fields);
+                free(jobs[j]->fields);
+                free(jobs[j]);
+            }
+            free(jobs);
+            jobs = NULL;
+            break;
+        }
+
+        BatchJob* job = checkAlloc(calloc(1, sizeof(BatchJob)));
+        job->fields = fields;
+        job->fileCount = fieldCount - 1;
+        for (size_t i = 1; i < fieldCount; i++) {
+            struct stat st;
+            if (stat(fields[i], &st) == 0) {
+                job->cost += st.st_size;
+            }
+        }
+
+        if (*jobCount == cap) {
+            cap *= 2;
+            jobs = checkAlloc(realloc(jobs, cap * sizeof(BatchJob*)));
+        }
+        jobs[(*jobCount)++] = job;
+    }
+
+    free(line);
+    fclose(fp);
+    return jobs;
+}
+
+int runBatch(const char* manifest, size_t workerCount, SortOptions* sortOptions, const char* cacheDir) {
+    size_t jobCount = 0;
+    BatchJob** jobs = readManifest(manifest, &jobCount);
+    if (jobs == NULL) {
+        fprintf(stderr, "Cannot read manifest %s\n", manifest);
+        return EXIT_FAILURE;
+    }
+
+    if (workerCount > jobCount) workerCount = jobCount;
+    if (workerCount == 0) workerCount = 1;
+
+    // Deal largest first, so every worker starts on a big catalog and the small ones fill the gaps
+    qsort(jobs, jobCount, sizeof(BatchJob*), compareJobCost);
+
+    WorkQueue* queues = checkAlloc(calloc(workerCount, sizeof(WorkQueue)));
+    for (size_t w = 0; w < workerCount; w++) {
+        pthread_mutex_init(&queues[w].lock, NULL);
+        queues[w].jobs = checkAlloc(malloc((jobCount / workerCount + 1) * sizeof(BatchJob*)));
+    }
+    // Fill back to front: the owner pops the big jobs from the back, thieves take the small ones from the front
+    for (size_t j = jobCount; j-- > 0;) {
+        WorkQueue* queue = &queues[j % workerCount];
+        queue->jobs[queue->tail++] = jobs[j];
+    }
+
+    Worker* workers = checkAlloc(calloc(workerCount, sizeof(Worker)));
+    for (size_t w = 0; w < workerCount; w++) {
+        workers[w].id = w;
+        workers[w].workerCount = workerCount;
+        workers[w].queues = queues;
+        workers[w].sortOptions = sortOptions;
+        workers[w].cacheDir = cacheDir;
+        if (pthread_create(&workers[w].thread, NULL, runWorker, &workers[w]) != 0) {
+            fprintf(stderr, "Cannot start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t w = 0; w < workerCount; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t j = 0; j < jobCount; j++) {
+        if (jobs[j]->failed != NULL) {
+            fprintf(stderr, "%s: failed at %s\n", jobs[j]->fields[0], jobs[j]->failed);
+            status = EXIT_FAILURE;
+        }
+        freeSet(jobs[j]->fields);
+        free(jobs[j]->fields);
+        free(jobs[j]);
+    }
+    for (size_t w = 0; w < workerCount; w++) {
+        pthread_mutex_destroy(&queues[w].lock);
+        free(queues[w].jobs);
+    }
+    free(queues);
+    free(workers);
+    free(jobs);
+    return status;
+}
+
+
+
+/*
+ Command line
+*/
+size_t parseByteSize(const char* str) {
+    char* end = NULL;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) return 0;
+
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; break;
+        case 'm': case 'M': value <<= 20; break;
+        case 'g': case 'G': value <<= 30; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return (size_t) value;
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--sort column] [--sort-mem bytes[K|M|G]] [--cache dir] [filename1] [filename2] ...\n", program);
+    fprintf(stderr, "       %s [--sort column] [--sort-mem bytes[K|M|G]] [--cache dir] [--threads n] --batch manifest\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    SortOptions sortOptions = { -1, 0, 64 << 20 };
+    const char* manifest = NULL;
+    const char* cacheDir = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    char** files = malloc(argc * sizeof(char*));
+    size_t fileCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sort") == 0) {
+            if (++i >= argc) usage(argv[0]);
+            sortOptions.column = findColumn(argv[i]);
+            sortOptions.numeric = sortOptions.column >= 0 && numericColumns[sortOptions.column];
+            if (sortOptions.column < 0) {
+                fprintf(stderr, "Unknown sort column %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--sort-mem") == 0) {
+            if (++i >= argc) usage(argv[0]);
+            sortOptions.memoryBudget = parseByteSize(argv[i]);
+            if (sortOptions.memoryBudget == 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            if (++i >= argc) usage(argv[0]);
+            manifest = argv[i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (++i >= argc) usage(argv[0]);
+            cacheDir = argv[i];
+            if (mkdir(cacheDir, 0755) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Cannot create cache directory %s\n", cacheDir);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (++i >= argc) usage(argv[0]);
+            threads = atol(argv[i]);
+            if (threads <= 0) usage(argv[0]);
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            usage(argv[0]);
+        } else {
+            files[fileCount++] = argv[i];
+        }
+    }
+
+    if (manifest != NULL) {
+        if (fileCount > 0) usage(argv[0]);
+        free(files);
+        return runBatch(manifest, threads > 0 ? threads : 1, &sortOptions, cacheDir);
+    }
+
+    if (processFiles(files, fileCount, "output.txt", &sortOptions, cacheDir) != NULL) {
+        exit(EXIT_FAILURE);
+    }
+    free(files);
 }